@@ -0,0 +1,166 @@
+#!/bin/sh
+# Runs fixed scenarios on every backend of gl_thread_simulation and fails on
+# accuracy or speed regressions.
+#
+#   ./check.sh              check physics and speed
+#   ./check.sh --baseline   record this machine's timings first
+#   ./check.sh --reference  re-record the physics reference first, after a
+#                           deliberate change to the physics
+#
+# Energy and momentum have absolute limits. Collision counts and mean overlap
+# must stay within a band around the committed brute force reference
+# (check_reference.txt): more hits or deeper overlaps mean worse physics,
+# fewer hits mean missed contacts. The fast mode resolves in scheduling order
+# and varies from run to run, so it gets a wider band. The maximum overlap is
+# reported only; pairs that linger pass through each other, so it sits near 1
+# whatever the kernel does.
+#
+# Speed depends on the machine, so timings are held to a per-machine
+# baseline (check_baseline.txt, not committed). They come from separate runs
+# without --metrics, best of TIMING_REPEATS.
+
+SIM=./gl_thread_simulation
+REFERENCE=check_reference.txt
+BASELINE=check_baseline.txt
+THREADS=${THREADS:-4}
+TIMING_STEPS=${TIMING_STEPS:-300}
+TIMING_REPEATS=${TIMING_REPEATS:-3}
+
+ENERGY_LIMIT=${ENERGY_LIMIT:-1e-4}         # |energy drift| relative to start
+MOMENTUM_LIMIT=${MOMENTUM_LIMIT:-1e-4}     # momentum changed by collisions, relative
+SPEED_TOLERANCE=${SPEED_TOLERANCE:-1.5}    # ms/step against baseline
+PHYSICS_TOLERANCE=${PHYSICS_TOLERANCE:-1.05}      # hits/step and mean overlap, either way
+FAST_PHYSICS_TOLERANCE=${FAST_PHYSICS_TOLERANCE:-1.5}
+
+# name, then the options that set it up
+SCENARIOS="
+uniform    --balls 1000 --radius 3 3 --steps 1000
+clustered  --balls 1000 --scenario clustered --radius 1 8 --steps 1000
+packed     --balls 2000 --scenario packed --radius 2 4 --steps 1000
+"
+
+# Serial brute force is the reference every deterministic backend must match
+# bit for bit. The fast threaded mode resolves in scheduling order, so it is
+# held to the limits only.
+BACKENDS="
+brute      --deterministic --threads 1 --broadphase brute
+grid       --deterministic --threads 1 --broadphase grid
+threaded   --deterministic --threads $THREADS
+fast       --threads $THREADS
+"
+
+REFERENCE_HEADER="# scenario mean-overlap hits/step (serial brute force)"
+BASELINE_HEADER="# scenario backend ms/step"
+record_reference=false
+record_baseline=false
+for option in "$@"; do
+    case $option in
+    --reference) record_reference=true ;;
+    --baseline) record_baseline=true ;;
+    *) echo "Usage: $0 [--baseline] [--reference]"; exit 1 ;;
+    esac
+done
+if $record_reference; then
+    echo "$REFERENCE_HEADER" > "$REFERENCE"
+elif [ "$(head -1 "$REFERENCE" 2>/dev/null)" != "$REFERENCE_HEADER" ]; then
+    echo "$REFERENCE is missing or from an older check.sh"
+    exit 1
+fi
+if $record_baseline; then
+    echo "$BASELINE_HEADER" > "$BASELINE"
+elif [ "$(head -1 "$BASELINE" 2>/dev/null)" != "$BASELINE_HEADER" ]; then
+    echo "No timing baseline for this machine in $BASELINE, record one with make baseline"
+    exit 1
+fi
+
+# Best ms/step of TIMING_REPEATS runs without --metrics
+time_run() {
+    best=
+    repeat=0
+    while [ $repeat -lt "$TIMING_REPEATS" ]; do
+        ms=$($SIM --seed 1 "$@" --steps "$TIMING_STEPS" < /dev/null | sed -n 2p | awk '{ print substr($6, 2) }')
+        [ -n "$ms" ] || return 1
+        best=$(awk -v a="$ms" -v b="$best" 'BEGIN { print (b == "" || a < b) ? a : b }')
+        repeat=$((repeat + 1))
+    done
+    echo "$best"
+}
+
+# check_run SCENARIO BACKEND OPTIONS...
+check_run() {
+    scenario=$1 backend=$2
+    shift 2
+    # Lines 2 and 3 of the headless output: timing and hash, then metrics
+    out=$($SIM --seed 1 "$@" --metrics < /dev/null | tail -2 | tr '\n' ' ')
+    ms=$(time_run "$@")
+    set -- $out
+    hash=${14} energy=${17} momentum=${20} max=${23} overlap=${26} hits=${28}
+    if [ -z "$hits" ] || [ -z "$ms" ]; then
+        echo "$scenario $backend: simulation failed"
+        exit 1
+    fi
+    if $record_reference && [ "$backend" = brute ]; then
+        echo "$scenario $overlap $hits" >> "$REFERENCE"
+    fi
+    if $record_baseline; then
+        echo "$scenario $backend $ms" >> "$BASELINE"
+    fi
+    physics=$(awk -v s="$scenario" '$1 == s { print $2, $3 }' "$REFERENCE")
+    speed=$(awk -v s="$scenario" -v b="$backend" '$1 == s && $2 == b { print $3 }' "$BASELINE")
+    if [ -z "$physics" ] || [ -z "$speed" ]; then
+        echo "$scenario $backend: not in $REFERENCE or $BASELINE"
+        exit 1
+    fi
+    tolerance=$PHYSICS_TOLERANCE
+    [ "$deterministic" = yes ] || tolerance=$FAST_PHYSICS_TOLERANCE
+    problems=$(echo "$speed $physics" | awk -v ms="$ms" -v e="$energy" -v m="$momentum" -v o="$overlap" -v h="$hits" \
+        -v el="$ENERGY_LIMIT" -v ml="$MOMENTUM_LIMIT" -v st="$SPEED_TOLERANCE" -v pt="$tolerance" '{
+            if (e < 0) e = -e
+            if (e > el) printf "energy>%s ", el
+            if (m > ml) printf "momentum>%s ", ml
+            if (ms > st * $1) printf "slower(%s) ", $1
+            if (o > pt * $2 || o < $2 / pt) printf "overlap(%s) ", $2
+            if (h > pt * $3 || h < $3 / pt) printf "hits(%s) ", $3
+        }')
+    if [ "$deterministic" = yes ]; then
+        if [ "$backend" = brute ]; then
+            reference=$hash
+        elif [ "$hash" != "$reference" ]; then
+            problems="${problems}hash!=brute"
+        fi
+    fi
+    printf "%-10s %-9s %9s %10s %10s %8s %8s %9s  %s\n" \
+        "$scenario" "$backend" "$ms" "$energy" "$momentum" "$max" "$overlap" "$hits" "${problems:-ok}"
+    [ -z "$problems" ] || failed=1
+}
+
+failed=0
+printf "%-10s %-9s %9s %10s %10s %8s %8s %9s  %s\n" \
+    scenario backend ms/step energy momentum max-ovl mean-ovl hits/step result
+while read -r scenario options; do
+    [ -n "$scenario" ] || continue
+    while read -r backend backend_options; do
+        [ -n "$backend" ] || continue
+        case " $backend_options " in
+        *" --deterministic "*) deterministic=yes ;;
+        *) deterministic=no ;;
+        esac
+        check_run "$scenario" "$backend" $options $backend_options
+    done <<EOF
+$BACKENDS
+EOF
+done <<EOF
+$SCENARIOS
+EOF
+
+if $record_reference; then
+    echo "physics reference written to $REFERENCE"
+fi
+if $record_baseline; then
+    echo "timings written to $BASELINE"
+fi
+if [ $failed -ne 0 ]; then
+    echo "FAILED"
+    exit 1
+fi
+echo "all ok"
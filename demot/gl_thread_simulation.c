@@ -1,18 +1,42 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <GL/glut.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <pthread.h>
 #include <signal.h>
 
+#include "parallel.h"
+
 #define WINDOW_WIDTH 1000
 #define WINDOW_HEIGHT 1000
+#ifndef NUM_BALLS
 #define NUM_BALLS 24 // Lisää palloja suorituskyvyn mittaamiseksi
+#endif
 #define BALL_RADIUS 5
 #define NUM_TRIANGLES 24
 #define NUM_THREADS 24
+#define MAX_LEVELS 16
+#define SLEEP_STEPS 60 // Slow steps before an island falls asleep
+#define DEFAULT_SEED 1
+#define NUM_CLUSTERS 16
+#define MAX_ATTEMPTS 1000 // Rejection sampling tries per ball
+#define TARGET_FPS 60
+#define TILE_SIZE 64
+#define SPLAT_BUDGET (1 << 20) // Balls splatted per frame; beyond that, a strided sample
+#define MAX_CIRCLES 10000      // Most balls drawn as real circles
+#define CIRCLE_VERTICES (3 * NUM_TRIANGLES)
+#define BIN_BALLS 64           // Mean balls per bin of the render index
+#define INDEX_FRAMES 8         // Fewest frames between render index rebuilds
+#define LOD_PIXELS 1.0f        // Mean on-screen radius below which balls are splatted
+#define OPAQUE_COUNT 16        // Balls per pixel shaded as fully opaque
+#define CHECKPOINT_MAGIC 0x42414c4c // "BALL"
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -22,61 +46,315 @@ typedef struct {
     float x, y;
     float vx, vy;
     float radius;
+    float mass;
+    int still; // Consecutive slow steps of its island; asleep at SLEEP_STEPS
     float r, g, b;
-    float vertices[NUM_TRIANGLES + 2][2];
 } Ball;
 
-Ball balls[NUM_BALLS];
-pthread_t threads[NUM_THREADS];
+typedef struct {
+    int a, b;
+} Contact;
+
+Ball *balls;
+int num_balls = NUM_BALLS;
+float circle[NUM_TRIANGLES + 2][2]; // Unit circle fan, scaled by each radius
 pthread_mutex_t ball_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 typedef struct {
     int start_idx;
     int end_idx;
+    Contact *contacts; // Deterministic mode: overlapping pairs found by this thread
+    int num_contacts;
+    int max_contacts;
+    long num_tests;    // Narrow-phase pair tests this step
+    long num_hits;     // Overlapping pairs this step
+    float max_overlap; // With --metrics: deepest overlap this step, as a fraction of both radii
+    double overlap_sum; // With --metrics: summed over this step's overlapping pairs
+    double energy, px, py; // With --metrics: kinetic energy and momentum of this range
 } ThreadData;
 
+// Hierarchical grid: level l has cells of size cell_size[0] * 2^l, and each
+// ball lives on the finest level whose cells are at least its diameter.
+// Cells of all levels share one index space; balls are radix sorted by cell.
 typedef struct {
-    pthread_t *threads;
-    int num_threads;
-    pthread_mutex_t queue_mutex;
-    pthread_cond_t queue_cond;
-    void (*task)(void *);
-    void *task_arg;
-    int stop;
-} ThreadPool;
+    int num_levels;
+    float cell_size[MAX_LEVELS];
+    int cols[MAX_LEVELS], rows[MAX_LEVELS];
+    int first_cell[MAX_LEVELS + 1];
+    int level_count[MAX_LEVELS];
+    int *cell_start;            // num_cells + 1 offsets into entries
+    int *ball_level;
+    uint32_t *cells;            // Per ball before sorting, per entry after
+    int *entries;               // Ball indices ordered by cell
+    uint32_t *tmp_cells;
+    int *tmp_entries;
+} Grid;
+
+enum { BROADPHASE_BRUTE, BROADPHASE_GRID };
+enum { SCENARIO_UNIFORM, SCENARIO_LATTICE, SCENARIO_CLUSTERED, SCENARIO_PACKED };
+
+ThreadPool pool;
+ThreadData thread_data[NUM_THREADS];
+int num_threads = NUM_THREADS;
+bool deterministic = false;
+int broadphase = BROADPHASE_GRID;
+float min_radius = BALL_RADIUS, max_radius = BALL_RADIUS;
+float sleep_speed = 0; // 0 disables sleeping
+int num_asleep = 0;
+int *sleeping; // Indices of the num_asleep sleeping balls, ascending
+int reorder_interval = 0; // Steps between sorting balls by cell; 0 never
+Ball *reorder_buffer;
+int num_reorders = 0; // Renumberings so far; each one invalidates the render index
+int scenario = SCENARIO_UNIFORM;
+int lattice_cols, lattice_rows;
+Grid grid;
+Contact *contacts, *sorted_contacts;
+uint32_t *contact_keys, *tmp_contact_keys; // Radix sort scratch, max_contacts each
+int *contact_order, *tmp_contact_order;
+int num_contacts, max_contacts;
+uint64_t sim_seed;
+uint64_t step_count = 0;
+bool metrics = false;
+double momentum_error = 0; // Momentum changed by collisions, summed over steps
+long num_hits = 0;
+float max_overlap = 0;
+double overlap_sum = 0;
 
 void handle_signal(int signal) {
     exit(0);
 }
-void init_balls() {
-    srand(time(NULL));
-    for (int i = 0; i < NUM_BALLS; i++) {
-        balls[i].x = rand() % (WINDOW_WIDTH - 2 * BALL_RADIUS) + BALL_RADIUS;
-        balls[i].y = rand() % (WINDOW_HEIGHT - 2 * BALL_RADIUS) + BALL_RADIUS;
-        balls[i].vx = ((float)rand() / RAND_MAX) * 2 - 1;
-        balls[i].vy = ((float)rand() / RAND_MAX) * 2 - 1;
-        balls[i].radius = BALL_RADIUS;
-        balls[i].r = (float)rand() / RAND_MAX;
-        balls[i].g = (float)rand() / RAND_MAX;
-        balls[i].b = (float)rand() / RAND_MAX;
 
-        balls[i].vertices[0][0] = 0.0f;
-        balls[i].vertices[0][1] = 0.0f;
-        for (int j = 0; j <= NUM_TRIANGLES; j++) {
-            float angle = j * (360.0f / NUM_TRIANGLES) * M_PI / 180.0f;
-            balls[i].vertices[j + 1][0] = cos(angle) * balls[i].radius;
-            balls[i].vertices[j + 1][1] = sin(angle) * balls[i].radius;
+// Counter-based RNG: the value depends only on (seed, index, stream), never on
+// call order, so any thread may generate any particle.
+uint64_t rng_mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+float rng_uniform(uint64_t seed, uint64_t index, uint64_t stream) {
+    uint64_t z = rng_mix(seed + 0x9e3779b97f4a7c15ULL * (index * 16 + stream + 1));
+    return (z >> 40) * (1.0f / 16777216.0f); // [0, 1)
+}
+
+bool is_asleep(const Ball *ball) {
+    return ball->still >= SLEEP_STEPS;
+}
+
+void init_circle() {
+    circle[0][0] = 0.0f;
+    circle[0][1] = 0.0f;
+    for (int j = 0; j <= NUM_TRIANGLES; j++) {
+        float angle = j * (360.0f / NUM_TRIANGLES) * M_PI / 180.0f;
+        circle[j + 1][0] = cos(angle);
+        circle[j + 1][1] = sin(angle);
+    }
+}
+
+// Plain malloc: large blocks come straight from mmap, so no page is placed
+// until a worker first writes its own range.
+int alloc_balls(int n) {
+    num_balls = n;
+    balls = malloc((size_t)n * sizeof(Ball));
+    sleeping = malloc((size_t)n * sizeof(int));
+    if (!balls || !sleeping) return -1;
+    int balls_per_thread = num_balls / num_threads;
+    for (int i = 0; i < num_threads; i++) {
+        thread_data[i].start_idx = i * balls_per_thread;
+        thread_data[i].end_idx = (i == num_threads - 1) ? num_balls : (i + 1) * balls_per_thread;
+    }
+    return 0;
+}
+
+void keep_inside(Ball *ball) {
+    if (ball->x < ball->radius) ball->x = ball->radius;
+    if (ball->x > WINDOW_WIDTH - ball->radius) ball->x = WINDOW_WIDTH - ball->radius;
+    if (ball->y < ball->radius) ball->y = ball->radius;
+    if (ball->y > WINDOW_HEIGHT - ball->radius) ball->y = WINDOW_HEIGHT - ball->radius;
+}
+
+void init_ball(int i) {
+    Ball *ball = &balls[i];
+    // Log-uniform radius, so every size class is equally represented
+    float radius = min_radius * powf(max_radius / min_radius, rng_uniform(sim_seed, i, 7));
+    ball->vx = rng_uniform(sim_seed, i, 2) * 2 - 1;
+    ball->vy = rng_uniform(sim_seed, i, 3) * 2 - 1;
+    ball->radius = radius;
+    ball->mass = radius * radius; // Uniform density disc
+    ball->still = 0;
+    ball->r = rng_uniform(sim_seed, i, 4);
+    ball->g = rng_uniform(sim_seed, i, 5);
+    ball->b = rng_uniform(sim_seed, i, 6);
+    switch (scenario) {
+    case SCENARIO_LATTICE: {
+        // Row-major grid as in balls.cc, spread to fill the window
+        float dx = (float)WINDOW_WIDTH / lattice_cols, dy = (float)WINDOW_HEIGHT / lattice_rows;
+        ball->x = (i % lattice_cols + 0.5f) * dx;
+        ball->y = (i / lattice_cols + 0.5f) * dy;
+        break;
+    }
+    case SCENARIO_CLUSTERED: {
+        // Gaussian blobs (Box-Muller) around centres drawn from the cluster index
+        int c = (int)(rng_uniform(sim_seed, i, 8) * NUM_CLUSTERS);
+        float cx = WINDOW_WIDTH * (0.1f + 0.8f * rng_uniform(~sim_seed, c, 0));
+        float cy = WINDOW_HEIGHT * (0.1f + 0.8f * rng_uniform(~sim_seed, c, 1));
+        float spread = WINDOW_WIDTH / 20.0f * sqrtf(-2 * logf(1 - rng_uniform(sim_seed, i, 9)));
+        float angle = 2 * M_PI * rng_uniform(sim_seed, i, 10);
+        ball->x = cx + spread * cosf(angle);
+        ball->y = cy + spread * sinf(angle);
+        break;
+    }
+    default:
+        ball->x = rng_uniform(sim_seed, i, 0) * (WINDOW_WIDTH - 2 * radius) + radius;
+        ball->y = rng_uniform(sim_seed, i, 1) * (WINDOW_HEIGHT - 2 * radius) + radius;
+        break;
+    }
+    keep_inside(ball);
+}
+
+void init_ball_range(void *arg) {
+    ThreadData *data = (ThreadData *)arg;
+    for (int i = data->start_idx; i < data->end_idx; i++) {
+        init_ball(i);
+    }
+}
+
+// Darts in a bucket grid at least one largest diameter wide, so overlaps can
+// only come from the 3x3 neighbourhood. Serial by nature: whether a dart fits
+// depends on every ball placed before it. Attempt a of ball i is drawn from
+// the counter RNG, so the packing still depends only on the seed.
+int pack_balls() {
+    float cell = sqrtf((float)WINDOW_WIDTH * WINDOW_HEIGHT / num_balls);
+    if (cell < 2 * max_radius) cell = 2 * max_radius;
+    int cols = (int)ceilf(WINDOW_WIDTH / cell), rows = (int)ceilf(WINDOW_HEIGHT / cell);
+    int *head = malloc((size_t)cols * rows * sizeof(int));
+    int *next = malloc((size_t)num_balls * sizeof(int));
+    for (int c = 0; c < cols * rows; c++) {
+        head[c] = -1;
+    }
+    int placed = 0;
+    for (int i = 0; i < num_balls; i++) {
+        Ball *ball = &balls[i];
+        for (int a = 0; a < MAX_ATTEMPTS && placed == i; a++) {
+            uint64_t seed = rng_mix(sim_seed + a);
+            ball->x = rng_uniform(seed, i, 0) * (WINDOW_WIDTH - 2 * ball->radius) + ball->radius;
+            ball->y = rng_uniform(seed, i, 1) * (WINDOW_HEIGHT - 2 * ball->radius) + ball->radius;
+            int cx = (int)(ball->x / cell), cy = (int)(ball->y / cell);
+            bool free_spot = true;
+            for (int y = cy - 1; free_spot && y <= cy + 1; y++) {
+                for (int x = cx - 1; free_spot && x <= cx + 1; x++) {
+                    if (x < 0 || y < 0 || x >= cols || y >= rows) continue;
+                    for (int j = head[y * cols + x]; j >= 0; j = next[j]) {
+                        float dx = ball->x - balls[j].x, dy = ball->y - balls[j].y;
+                        float reach = ball->radius + balls[j].radius;
+                        if (dx * dx + dy * dy < reach * reach) {
+                            free_spot = false;
+                            break;
+                        }
+                    }
+                }
+            }
+            if (free_spot) {
+                next[i] = head[cy * cols + cx];
+                head[cy * cols + cx] = i;
+                placed++;
+            }
         }
+        if (placed == i) break;
     }
+    free(head);
+    free(next);
+    return placed == num_balls ? 0 : -1;
 }
 
-void draw_ball(Ball *ball) {
-    glColor3f(ball->r, ball->g, ball->b);
-    glBegin(GL_TRIANGLE_FAN);
-    for (int i = 0; i <= NUM_TRIANGLES + 1; i++) {
-        glVertex2f(ball->x + ball->vertices[i][0], ball->y + ball->vertices[i][1]);
+int init_balls() {
+    if (scenario == SCENARIO_LATTICE) {
+        lattice_cols = (int)ceilf(sqrtf((float)num_balls * WINDOW_WIDTH / WINDOW_HEIGHT));
+        lattice_rows = (num_balls + lattice_cols - 1) / lattice_cols;
     }
-    glEnd();
+    thread_pool_submit(&pool, init_ball_range, thread_data, sizeof(ThreadData), num_threads);
+    step_count = 0;
+    return scenario == SCENARIO_PACKED ? pack_balls() : 0;
+}
+
+void touch_ball_range(void *arg) {
+    ThreadData *data = (ThreadData *)arg;
+    memset(balls + data->start_idx, 0, (data->end_idx - data->start_idx) * sizeof(Ball));
+}
+
+// Streams "x y vx vy radius" lines after a count line straight into place;
+// colours come from the seed. Pages are first touched by their workers.
+int load_particles(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    int n;
+    if (fscanf(f, "%d", &n) != 1 || n < 1 || alloc_balls(n)) {
+        fclose(f);
+        return -1;
+    }
+    thread_pool_submit(&pool, touch_ball_range, thread_data, sizeof(ThreadData), num_threads);
+    int ok = 1;
+    for (int i = 0; ok && i < n; i++) {
+        Ball *ball = &balls[i];
+        ok = fscanf(f, "%f %f %f %f %f", &ball->x, &ball->y, &ball->vx, &ball->vy, &ball->radius) == 5 &&
+             ball->radius > 0;
+        ball->mass = ball->radius * ball->radius;
+        ball->r = rng_uniform(sim_seed, i, 4);
+        ball->g = rng_uniform(sim_seed, i, 5);
+        ball->b = rng_uniform(sim_seed, i, 6);
+    }
+    fclose(f);
+    step_count = 0;
+    return ok ? 0 : -1;
+}
+
+// Checkpoint holds everything the next step depends on.
+int save_checkpoint(const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+    uint32_t header[3] = {CHECKPOINT_MAGIC, num_balls, sizeof(Ball)};
+    fwrite(header, sizeof(header), 1, f);
+    fwrite(&sim_seed, sizeof(sim_seed), 1, f);
+    fwrite(&step_count, sizeof(step_count), 1, f);
+    fwrite(balls, sizeof(Ball), num_balls, f);
+    return fclose(f);
+}
+
+void list_sleeping() {
+    num_asleep = 0;
+    for (int i = 0; i < num_balls; i++) {
+        if (is_asleep(&balls[i])) sleeping[num_asleep++] = i;
+    }
+}
+
+int load_checkpoint(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    uint32_t header[3];
+    int ok = fread(header, sizeof(header), 1, f) == 1 &&
+             header[0] == CHECKPOINT_MAGIC && header[1] > 0 && header[2] == sizeof(Ball) &&
+             fread(&sim_seed, sizeof(sim_seed), 1, f) == 1 &&
+             fread(&step_count, sizeof(step_count), 1, f) == 1 &&
+             alloc_balls(header[1]) == 0;
+    if (ok) {
+        thread_pool_submit(&pool, touch_ball_range, thread_data, sizeof(ThreadData), num_threads);
+        ok = fread(balls, sizeof(Ball), num_balls, f) == (size_t)num_balls;
+    }
+    if (ok) list_sleeping();
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+// FNV-1a over the dynamic state, for comparing runs bit for bit.
+uint64_t state_hash() {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < num_balls; i++) {
+        const unsigned char *p = (const unsigned char *)&balls[i];
+        for (size_t k = 0; k < 4 * sizeof(float); k++) {
+            h = (h ^ p[k]) * 0x100000001b3ULL;
+        }
+    }
+    return h;
 }
 
 void move_ball(Ball *ball) {
@@ -108,8 +386,8 @@ void resolve_collision(Ball *b1, Ball *b2) {
         float new_speed2x = speed2 * cos(direction2 - collision_angle);
         float new_speed2y = speed2 * sin(direction2 - collision_angle);
 
-        float final_speed1x = ((b1->radius - b2->radius) * new_speed1x + (2 * b2->radius) * new_speed2x) / (b1->radius + b2->radius);
-        float final_speed2x = ((2 * b1->radius) * new_speed1x + (b2->radius - b1->radius) * new_speed2x) / (b1->radius + b2->radius);
+        float final_speed1x = ((b1->mass - b2->mass) * new_speed1x + (2 * b2->mass) * new_speed2x) / (b1->mass + b2->mass);
+        float final_speed2x = ((2 * b1->mass) * new_speed1x + (b2->mass - b1->mass) * new_speed2x) / (b1->mass + b2->mass);
 
         b1->vx = cos(collision_angle) * final_speed1x + cos(collision_angle + M_PI / 2) * new_speed1y;
         b1->vy = sin(collision_angle) * final_speed1x + sin(collision_angle + M_PI / 2) * new_speed1y;
@@ -117,6 +395,69 @@ void resolve_collision(Ball *b1, Ball *b2) {
         b2->vy = sin(collision_angle) * final_speed2x + sin(collision_angle + M_PI / 2) * new_speed2y;
     }
 }
+void init_grid(Grid *grid) {
+    float smallest = balls[0].radius, largest = balls[0].radius;
+    for (int i = 1; i < num_balls; i++) {
+        if (balls[i].radius < smallest) smallest = balls[i].radius;
+        if (balls[i].radius > largest) largest = balls[i].radius;
+    }
+    // Cells finer than about one ball each would only cost memory and clearing.
+    float cell = sqrtf((float)WINDOW_WIDTH * WINDOW_HEIGHT / num_balls);
+    if (cell < 2 * smallest) cell = 2 * smallest;
+    grid->num_levels = 0;
+    grid->first_cell[0] = 0;
+    for (; grid->num_levels < MAX_LEVELS; cell *= 2) {
+        int l = grid->num_levels++;
+        grid->cell_size[l] = cell;
+        grid->cols[l] = (int)ceilf(WINDOW_WIDTH / cell);
+        grid->rows[l] = (int)ceilf(WINDOW_HEIGHT / cell);
+        grid->first_cell[l + 1] = grid->first_cell[l] + grid->cols[l] * grid->rows[l];
+        if (cell >= 2 * largest) break;
+    }
+    grid->cell_start = malloc((grid->first_cell[grid->num_levels] + 1) * sizeof(int));
+    grid->ball_level = malloc(num_balls * sizeof(int));
+    grid->cells = malloc(num_balls * sizeof(uint32_t));
+    grid->entries = malloc(num_balls * sizeof(int));
+    grid->tmp_cells = malloc(num_balls * sizeof(uint32_t));
+    grid->tmp_entries = malloc(num_balls * sizeof(int));
+    for (int i = 0; i < num_balls; i++) {
+        int l = 0;
+        while (l < grid->num_levels - 1 && grid->cell_size[l] < 2 * balls[i].radius) l++;
+        grid->ball_level[i] = l;
+    }
+}
+
+// Clamped, so balls slightly past a wall still land in a border cell.
+void grid_coords(const Grid *grid, int l, float x, float y, int *cx, int *cy) {
+    *cx = (int)(x / grid->cell_size[l]);
+    *cy = (int)(y / grid->cell_size[l]);
+    if (*cx < 0) *cx = 0;
+    if (*cx >= grid->cols[l]) *cx = grid->cols[l] - 1;
+    if (*cy < 0) *cy = 0;
+    if (*cy >= grid->rows[l]) *cy = grid->rows[l] - 1;
+}
+
+void grid_cells(void *arg) {
+    ThreadData *data = (ThreadData *)arg;
+    for (int i = data->start_idx; i < data->end_idx; i++) {
+        int l = grid.ball_level[i], cx, cy;
+        grid_coords(&grid, l, balls[i].x, balls[i].y, &cx, &cy);
+        grid.cells[i] = grid.first_cell[l] + cy * grid.cols[l] + cx;
+        grid.entries[i] = i;
+    }
+}
+
+// Each cell start is written by the first sorted entry at or past that cell.
+void grid_cell_starts(void *arg) {
+    ThreadData *data = (ThreadData *)arg;
+    for (int k = data->start_idx; k < data->end_idx; k++) {
+        uint32_t first = k ? grid.cells[k - 1] + 1 : 0;
+        for (uint32_t c = first; c <= grid.cells[k]; c++) {
+            grid.cell_start[c] = k;
+        }
+    }
+}
+
 /*
 void *update_balls(void *arg) {
     ThreadData *data = (ThreadData *)arg;
@@ -136,13 +477,6 @@ void *update_balls(void *arg) {
     return NULL;
 }
 */
-void display() {
-    glClear(GL_COLOR_BUFFER_BIT);
-    for (int i = 0; i < NUM_BALLS; i++) {
-        draw_ball(&balls[i]);
-    }
-    glutSwapBuffers();
-}
 /*
 void update() {
     ThreadData thread_data[NUM_THREADS];
@@ -163,107 +497,906 @@ void update() {
 */
 void init() {
     glClearColor(1.0, 1.0, 1.0, 1.0);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluOrtho2D(0.0, WINDOW_WIDTH, 0.0, WINDOW_HEIGHT);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 }
 
 //here start paste
-void *thread_pool_worker(void *arg) {
-    ThreadPool *pool = (ThreadPool *)arg;
-    while (1) {
-        pthread_mutex_lock(&pool->queue_mutex);
-        while (pool->task == NULL && !pool->stop) {
-            pthread_cond_wait(&pool->queue_cond, &pool->queue_mutex);
+void move_balls(void *arg) {
+    ThreadData *data = (ThreadData *)arg;
+    for (int i = data->start_idx; i < data->end_idx; i++) {
+        if (!is_asleep(&balls[i])) move_ball(&balls[i]);
+    }
+}
+
+// Overlapping pairs are recorded for the canonical pass in deterministic mode
+// and resolved on the spot otherwise; they are also recorded for the island
+// pass when sleeping is enabled. Positions are frozen during this pass.
+void test_pair(ThreadData *data, int i, int j) {
+    float dx = balls[i].x - balls[j].x;
+    float dy = balls[i].y - balls[j].y;
+    float reach = balls[i].radius + balls[j].radius;
+    data->num_tests++;
+    if (dx * dx + dy * dy >= reach * reach) return;
+    data->num_hits++;
+    if (metrics) {
+        float overlap = 1 - sqrtf(dx * dx + dy * dy) / reach;
+        if (overlap > data->max_overlap) data->max_overlap = overlap;
+        data->overlap_sum += overlap;
+    }
+    if (!deterministic) {
+        pthread_mutex_lock(&ball_mutex);
+        resolve_collision(&balls[i], &balls[j]);
+        pthread_mutex_unlock(&ball_mutex);
+        if (sleep_speed == 0) return;
+    }
+    if (data->num_contacts == data->max_contacts) {
+        data->max_contacts = data->max_contacts ? 2 * data->max_contacts : 64;
+        data->contacts = realloc(data->contacts, data->max_contacts * sizeof(Contact));
+    }
+    data->contacts[data->num_contacts++] = i < j ? (Contact){i, j} : (Contact){j, i};
+}
+
+// Only awake balls query. Each pair is tested once: same-level pairs by the
+// lower index, cross-level pairs by the smaller ball, which looks up its 3x3
+// neighbourhood on every coarser level (a coarser cell is at least as wide as
+// both radii together). Sleeping balls never query, so whoever touches them
+// must find them: any index on the same level, and on finer levels a window
+// wide enough for the finest ball there.
+void query_grid(ThreadData *data, int i) {
+    int level = grid.ball_level[i];
+    for (int l = num_asleep ? 0 : level; l < grid.num_levels; l++) {
+        if (grid.level_count[l] == 0) continue;
+        float reach = l < level ? balls[i].radius + grid.cell_size[l] / 2 : grid.cell_size[l];
+        int x0, y0, x1, y1;
+        grid_coords(&grid, l, balls[i].x - reach, balls[i].y - reach, &x0, &y0);
+        grid_coords(&grid, l, balls[i].x + reach, balls[i].y + reach, &x1, &y1);
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                int cell = grid.first_cell[l] + y * grid.cols[l] + x;
+                for (int e = grid.cell_start[cell]; e < grid.cell_start[cell + 1]; e++) {
+                    int j = grid.entries[e];
+                    if (is_asleep(&balls[j]) ? j == i : (l < level || (l == level && j <= i))) continue;
+                    test_pair(data, i, j);
+                }
+            }
         }
-        if (pool->stop) {
-            pthread_mutex_unlock(&pool->queue_mutex);
-            break;
+    }
+}
+
+void find_contacts(void *arg) {
+    ThreadData *data = (ThreadData *)arg;
+    data->num_contacts = 0;
+    data->num_tests = 0;
+    data->num_hits = 0;
+    data->max_overlap = 0;
+    data->overlap_sum = 0;
+    for (int i = data->start_idx; i < data->end_idx; i++) {
+        if (is_asleep(&balls[i])) continue;
+        if (broadphase == BROADPHASE_GRID) {
+            query_grid(data, i);
+        } else {
+            // Sleepers never query, so i also takes those below it.
+            for (int s = 0; s < num_asleep && sleeping[s] < i; s++) {
+                test_pair(data, i, sleeping[s]);
+            }
+            for (int j = i + 1; j < num_balls; j++) {
+                test_pair(data, i, j);
+            }
         }
-        void (*task)(void *) = pool->task;
-        void *task_arg = pool->task_arg;
-        pool->task = NULL;
-        pthread_mutex_unlock(&pool->queue_mutex);
-        task(task_arg);
     }
-    return NULL;
 }
 
-void thread_pool_init(ThreadPool *pool, int num_threads) {
-    pool->num_threads = num_threads;
-    pool->threads = malloc(num_threads * sizeof(pthread_t));
-    pthread_mutex_init(&pool->queue_mutex, NULL);
-    pthread_cond_init(&pool->queue_cond, NULL);
-    pool->task = NULL;
-    pool->stop = 0;
-    for (int i = 0; i < num_threads; i++) {
-        pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool);
+int find_island(int *parent, int i) {
+    while (parent[i] != i) {
+        i = parent[i] = parent[parent[i]];
     }
+    return i;
 }
 
-void thread_pool_submit(ThreadPool *pool, void (*task)(void *), void *arg) {
-    pthread_mutex_lock(&pool->queue_mutex);
-    pool->task = task;
-    pool->task_arg = arg;
-    pthread_cond_signal(&pool->queue_cond);
-    pthread_mutex_unlock(&pool->queue_mutex);
+// Touching balls form islands (union-find over this step's contacts). An
+// island sleeps once every member has been slower than sleep_speed for
+// SLEEP_STEPS steps; a fast or freshly hit member wakes all of it. Contacts
+// are only found around awake balls, so a sleeping pile wakes layer by layer.
+void update_sleep() {
+    static int *parent, *island_still;
+    if (!parent) {
+        parent = malloc(num_balls * sizeof(int));
+        island_still = malloc(num_balls * sizeof(int));
+    }
+    for (int i = 0; i < num_balls; i++) {
+        parent[i] = i;
+        island_still[i] = SLEEP_STEPS;
+    }
+    for (int t = 0; t < num_threads; t++) {
+        for (int k = 0; k < thread_data[t].num_contacts; k++) {
+            int a = find_island(parent, thread_data[t].contacts[k].a);
+            int b = find_island(parent, thread_data[t].contacts[k].b);
+            parent[a < b ? b : a] = a < b ? a : b;
+        }
+    }
+    for (int i = 0; i < num_balls; i++) {
+        Ball *ball = &balls[i];
+        bool slow = ball->vx * ball->vx + ball->vy * ball->vy < sleep_speed * sleep_speed;
+        ball->still = slow ? (ball->still < SLEEP_STEPS ? ball->still + 1 : SLEEP_STEPS) : 0;
+        int root = find_island(parent, i);
+        if (ball->still < island_still[root]) island_still[root] = ball->still;
+    }
+    num_asleep = 0;
+    for (int i = 0; i < num_balls; i++) {
+        balls[i].still = island_still[find_island(parent, i)];
+        if (is_asleep(&balls[i])) {
+            balls[i].vx = balls[i].vy = 0;
+            sleeping[num_asleep++] = i;
+        }
+    }
 }
-void thread_pool_shutdown(ThreadPool *pool) {
-    pthread_mutex_lock(&pool->queue_mutex);
-    pool->stop = 1;
-    pthread_cond_broadcast(&pool->queue_cond);
-    pthread_mutex_unlock(&pool->queue_mutex);
-    for (int i = 0; i < pool->num_threads; i++) {
-        pthread_join(pool->threads[i], NULL);
+
+void build_grid() {
+    int num_cells = grid.first_cell[grid.num_levels];
+    thread_pool_submit(&pool, grid_cells, thread_data, sizeof(ThreadData), num_threads);
+    parallel_radix_sort(&pool, grid.cells, grid.entries, num_balls, num_cells - 1,
+                        grid.tmp_cells, grid.tmp_entries);
+    thread_pool_submit(&pool, grid_cell_starts, thread_data, sizeof(ThreadData), num_threads);
+    for (int c = grid.cells[num_balls - 1] + 1; c <= num_cells; c++) {
+        grid.cell_start[c] = num_balls;
+    }
+    for (int l = 0; l < grid.num_levels; l++) {
+        grid.level_count[l] = grid.cell_start[grid.first_cell[l + 1]] - grid.cell_start[grid.first_cell[l]];
     }
-    free(pool->threads);
-    pthread_mutex_destroy(&pool->queue_mutex);
-    pthread_cond_destroy(&pool->queue_cond);
 }
 
-void *update_balls(void *arg) {
+void gather_balls(void *arg) {
     ThreadData *data = (ThreadData *)arg;
-    for (int i = data->start_idx; i < data->end_idx; i++) {
-        move_ball(&balls[i]);
+    for (int k = data->start_idx; k < data->end_idx; k++) {
+        reorder_buffer[k] = balls[grid.entries[k]];
+        grid.tmp_entries[k] = grid.ball_level[grid.entries[k]];
+    }
+}
+
+void scatter_balls(void *arg) {
+    ThreadData *data = (ThreadData *)arg;
+    for (int k = data->start_idx; k < data->end_idx; k++) {
+        balls[k] = reorder_buffer[k];
+        grid.ball_level[k] = grid.tmp_entries[k];
+        grid.entries[k] = k;
+    }
+}
+
+// Renumbers balls in cell order so grid neighbours are also memory neighbours.
+void reorder_balls() {
+    if (!reorder_buffer) reorder_buffer = malloc(num_balls * sizeof(Ball));
+    thread_pool_submit(&pool, gather_balls, thread_data, sizeof(ThreadData), num_threads);
+    thread_pool_submit(&pool, scatter_balls, thread_data, sizeof(ThreadData), num_threads);
+    num_reorders++;
+    if (num_asleep) list_sleeping();
+}
+
+// Two stable passes, by b and then by a, leave the contacts in (a, b) order.
+void sort_contacts() {
+    for (int k = 0; k < num_contacts; k++) {
+        contact_keys[k] = contacts[k].b;
+        contact_order[k] = k;
+    }
+    parallel_radix_sort(&pool, contact_keys, contact_order, num_contacts, num_balls - 1,
+                        tmp_contact_keys, tmp_contact_order);
+    for (int k = 0; k < num_contacts; k++) {
+        contact_keys[k] = contacts[contact_order[k]].a;
     }
+    parallel_radix_sort(&pool, contact_keys, contact_order, num_contacts, num_balls - 1,
+                        tmp_contact_keys, tmp_contact_order);
+    for (int k = 0; k < num_contacts; k++) {
+        sorted_contacts[k] = contacts[contact_order[k]];
+    }
+    Contact *swap = contacts;
+    contacts = sorted_contacts;
+    sorted_contacts = swap;
+}
+
+void measure_balls(void *arg) {
+    ThreadData *data = (ThreadData *)arg;
+    double energy = 0, px = 0, py = 0;
     for (int i = data->start_idx; i < data->end_idx; i++) {
-        for (int j = i + 1; j < NUM_BALLS; j++) {
-            pthread_mutex_lock(&ball_mutex);
-            resolve_collision(&balls[i], &balls[j]);
-            pthread_mutex_unlock(&ball_mutex);
+        const Ball *ball = &balls[i];
+        energy += 0.5 * ball->mass * (ball->vx * ball->vx + ball->vy * ball->vy);
+        px += ball->mass * ball->vx;
+        py += ball->mass * ball->vy;
+    }
+    data->energy = energy;
+    data->px = px;
+    data->py = py;
+}
+
+// Sums in thread order, so the result does not depend on scheduling.
+void measure(double *energy, double *px, double *py) {
+    thread_pool_submit(&pool, measure_balls, thread_data, sizeof(ThreadData), num_threads);
+    *energy = *px = *py = 0;
+    for (int t = 0; t < num_threads; t++) {
+        *energy += thread_data[t].energy;
+        *px += thread_data[t].px;
+        *py += thread_data[t].py;
+    }
+}
+
+void step() {
+    double energy, px, py;
+    thread_pool_submit(&pool, move_balls, thread_data, sizeof(ThreadData), num_threads);
+    if (broadphase == BROADPHASE_GRID) {
+        build_grid();
+        if (reorder_interval && step_count % reorder_interval == 0) {
+            reorder_balls();
+        }
+    }
+    // Walls change momentum, collisions must not: compare across the collision pass only.
+    if (metrics) measure(&energy, &px, &py);
+    thread_pool_submit(&pool, find_contacts, thread_data, sizeof(ThreadData), num_threads);
+    if (deterministic) {
+        // Resolve in (i, j) order, the serial all-pairs order, whatever the
+        // thread count or broad phase.
+        void *lists[NUM_THREADS];
+        int counts[NUM_THREADS];
+        int total = 0;
+        for (int t = 0; t < num_threads; t++) {
+            lists[t] = thread_data[t].contacts;
+            counts[t] = thread_data[t].num_contacts;
+            total += counts[t];
         }
+        if (total > max_contacts) {
+            max_contacts = 2 * total;
+            contacts = realloc(contacts, max_contacts * sizeof(Contact));
+            sorted_contacts = realloc(sorted_contacts, max_contacts * sizeof(Contact));
+            contact_keys = realloc(contact_keys, max_contacts * sizeof(uint32_t));
+            tmp_contact_keys = realloc(tmp_contact_keys, max_contacts * sizeof(uint32_t));
+            contact_order = realloc(contact_order, max_contacts * sizeof(int));
+            tmp_contact_order = realloc(tmp_contact_order, max_contacts * sizeof(int));
+        }
+        num_contacts = parallel_compact(&pool, lists, counts, num_threads, contacts, sizeof(Contact));
+        if (broadphase == BROADPHASE_GRID || num_asleep) {
+            sort_contacts();
+        }
+        for (int k = 0; k < num_contacts; k++) {
+            resolve_collision(&balls[contacts[k].a], &balls[contacts[k].b]);
+        }
+    }
+    if (metrics) {
+        double px0 = px, py0 = py;
+        measure(&energy, &px, &py);
+        momentum_error += hypot(px - px0, py - py0);
+        for (int t = 0; t < num_threads; t++) {
+            num_hits += thread_data[t].num_hits;
+            overlap_sum += thread_data[t].overlap_sum;
+            if (thread_data[t].max_overlap > max_overlap) max_overlap = thread_data[t].max_overlap;
+        }
+    }
+    if (sleep_speed > 0) {
+        update_sleep();
+    }
+    step_count++;
+}
+
+long pair_tests() {
+    long tests = 0;
+    for (int t = 0; t < num_threads; t++) {
+        tests += thread_data[t].num_tests;
+    }
+    return tests;
+}
+
+// Runs as fast as it can on its own thread; frames sample whatever it has.
+void *simulate(void *arg) {
+    while (1) {
+        step();
     }
     return NULL;
 }
-void update() {
-    ThreadPool pool;
-    thread_pool_init(&pool, NUM_THREADS);
-    ThreadData thread_data[NUM_THREADS];
-    int balls_per_thread = NUM_BALLS / NUM_THREADS;
 
-    for (int i = 0; i < NUM_THREADS; i++) {
-        thread_data[i].start_idx = i * balls_per_thread;
-        thread_data[i].end_idx = (i == NUM_THREADS - 1) ? NUM_BALLS : (i + 1) * balls_per_thread;
-        thread_pool_submit(&pool, update_balls, &thread_data[i]);
+void init_threads() {
+    if (broadphase == BROADPHASE_GRID) {
+        init_grid(&grid);
+    }
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    int start_idx;
+    int end_idx;
+    uint32_t *keys;  // Tile of each visible ball
+    int *values;     // Ball index for circles, packed pixel and colour for splatting
+    int count;
+    int capacity;
+    int row0, row1;    // Bin rows to cull when the render index is used
+    int offset;        // Of this task's balls in visible
+    float max_speed;   // Fastest ball binned by this task
+} CullTask;
+
+ThreadPool render_pool; // The simulation thread owns pool
+CullTask cull_tasks[NUM_THREADS];
+int *tile_ids;
+unsigned char *pixels;  // win_w x win_h RGB
+uint32_t *visible_keys, *tmp_keys;
+int *visible, *tmp_visible;
+int num_visible, max_visible;
+int win_w = WINDOW_WIDTH, win_h = WINDOW_HEIGHT;
+int tiles_x, tiles_y;
+float view_x = 0, view_y = 0, view_scale = 1; // World point at the lower-left pixel, pixels per unit
+float mean_radius;
+int frame_stride;
+bool frame_circles;
+bool frame_indexed;     // Culled through the render index rather than a scan
+int frame_bx0, frame_bx1; // Bin columns in view
+float *circle_vertices; // MAX_CIRCLES circles of CIRCLE_VERTICES
+unsigned char *circle_colors;
+float largest_radius;
+
+// Render index: balls radix sorted by square bin, so a zoomed-in frame only
+// reads the bins in view. Balls keep moving, so the view is widened by how
+// far they may have gone since the build; the index is rebuilt once that is
+// more than a bin, but at most every INDEX_FRAMES frames. The speed bound is
+// taken at the build, so a ball sped up since may pop in late at the edge.
+uint32_t *bin_keys, *tmp_bin_keys;
+int *bin_entries, *tmp_bin_entries;
+int *bin_start;         // bins_x * bins_y + 1 offsets into bin_entries
+int bins_x, bins_y;
+float bin_size;
+bool index_built = false;
+uint64_t index_step;
+int index_reorders, index_age;
+float index_speed;
+float coverage[OPAQUE_COUNT + 1]; // Opacity by balls per pixel, for the current stride
+int drag_x, drag_y;
+bool dragging = false;
+double fps_start;
+bool timer_pending = false;
+int fps_frames;
+uint64_t fps_steps;
+
+void resize_frame(int w, int h) {
+    win_w = w;
+    win_h = h;
+    tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+    tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
+    free(tile_ids);
+    free(pixels);
+    tile_ids = malloc(tiles_x * tiles_y * sizeof(int));
+    for (int t = 0; t < tiles_x * tiles_y; t++) {
+        tile_ids[t] = t;
+    }
+    pixels = malloc((size_t)w * h * 3);
+}
+
+void init_render() {
+    double sum = 0;
+    for (int i = 0; i < num_balls; i++) {
+        sum += balls[i].radius;
+    }
+    mean_radius = sum / num_balls;
+    largest_radius = 0;
+    for (int i = 0; i < num_balls; i++) {
+        if (balls[i].radius > largest_radius) largest_radius = balls[i].radius;
+    }
+    bin_size = sqrtf((float)WINDOW_WIDTH * WINDOW_HEIGHT * BIN_BALLS / num_balls);
+    bins_x = (int)ceilf(WINDOW_WIDTH / bin_size);
+    bins_y = (int)ceilf(WINDOW_HEIGHT / bin_size);
+    circle_vertices = malloc((size_t)MAX_CIRCLES * CIRCLE_VERTICES * 2 * sizeof(float));
+    circle_colors = malloc((size_t)MAX_CIRCLES * CIRCLE_VERTICES * 3);
+    for (int t = 0; t < num_threads; t++) {
+        cull_tasks[t].start_idx = thread_data[t].start_idx;
+        cull_tasks[t].end_idx = thread_data[t].end_idx;
+    }
+    // Frames are built while the simulation runs, on the CPUs after its own.
+    thread_pool_init_at(&render_pool, num_threads, num_threads);
+    resize_frame(win_w, win_h);
+}
+
+int bin_coord(float v, int bins) {
+    int b = (int)(v / bin_size);
+    return b < 0 ? 0 : b >= bins ? bins - 1 : b;
+}
+
+void bin_balls(void *arg) {
+    CullTask *task = (CullTask *)arg;
+    float max_speed2 = 0;
+    for (int i = task->start_idx; i < task->end_idx; i++) {
+        const Ball *ball = &balls[i];
+        bin_keys[i] = bin_coord(ball->y, bins_y) * bins_x + bin_coord(ball->x, bins_x);
+        bin_entries[i] = i;
+        float speed2 = ball->vx * ball->vx + ball->vy * ball->vy;
+        if (speed2 > max_speed2) max_speed2 = speed2;
+    }
+    task->max_speed = sqrtf(max_speed2);
+}
+
+void bin_starts(void *arg) {
+    CullTask *task = (CullTask *)arg;
+    for (int k = task->start_idx; k < task->end_idx; k++) {
+        uint32_t first = k ? bin_keys[k - 1] + 1 : 0;
+        for (uint32_t c = first; c <= bin_keys[k]; c++) {
+            bin_start[c] = k;
+        }
+    }
+}
+
+void build_index() {
+    int num_bins = bins_x * bins_y;
+    if (!bin_keys) {
+        bin_keys = malloc(num_balls * sizeof(uint32_t));
+        tmp_bin_keys = malloc(num_balls * sizeof(uint32_t));
+        bin_entries = malloc(num_balls * sizeof(int));
+        tmp_bin_entries = malloc(num_balls * sizeof(int));
+        bin_start = malloc((num_bins + 1) * sizeof(int));
+    }
+    index_step = step_count;
+    index_reorders = num_reorders;
+    thread_pool_submit(&render_pool, bin_balls, cull_tasks, sizeof(CullTask), num_threads);
+    parallel_radix_sort(&render_pool, bin_keys, bin_entries, num_balls, num_bins - 1,
+                        tmp_bin_keys, tmp_bin_entries);
+    thread_pool_submit(&render_pool, bin_starts, cull_tasks, sizeof(CullTask), num_threads);
+    for (int c = bin_keys[num_balls - 1] + 1; c <= num_bins; c++) {
+        bin_start[c] = num_balls;
+    }
+    index_speed = 0;
+    for (int t = 0; t < num_threads; t++) {
+        if (cull_tasks[t].max_speed > index_speed) index_speed = cull_tasks[t].max_speed;
+    }
+    index_built = true;
+    index_age = 0;
+}
+
+// How far balls may have moved from their bins
+float index_drift() {
+    return (step_count - index_step) * index_speed;
+}
+
+void update_index() {
+    index_age++;
+    if (index_built && index_reorders == num_reorders &&
+        (index_drift() <= bin_size || index_age < INDEX_FRAMES)) return;
+    build_index();
+}
+
+// Culls entries [e0, e1), ball indices or the balls themselves when entries
+// is NULL. Only every frame_stride-th is kept when splatting, counted
+// frame_stride times, so the work per frame stays within SPLAT_BUDGET. For
+// splatting the value carries everything the tile needs (pixel in the tile
+// above RGB565), so no ball is read twice. Returns false once there are too
+// many circles to draw.
+bool cull_range(CullTask *task, const int *entries, int e0, int e1) {
+    int first = (e0 + frame_stride - 1) / frame_stride * frame_stride;
+    for (int e = first; e < e1; e += frame_stride) {
+        int i = entries ? entries[e] : e;
+        const Ball *ball = &balls[i];
+        float px = (ball->x - view_x) * view_scale;
+        float py = (ball->y - view_y) * view_scale;
+        float pr = ball->radius * view_scale;
+        if (px + pr < 0 || py + pr < 0 || px - pr >= win_w || py - pr >= win_h) continue;
+        int x = px < 0 ? 0 : px >= win_w ? win_w - 1 : (int)px;
+        int y = py < 0 ? 0 : py >= win_h ? win_h - 1 : (int)py;
+        task->keys[task->count] = (y / TILE_SIZE) * tiles_x + x / TILE_SIZE;
+        if (frame_circles) {
+            task->values[task->count++] = i;
+            if (task->count > MAX_CIRCLES) return false;
+        } else {
+            int rgb = (int)(ball->r * 31.99f) << 11 | (int)(ball->g * 63.99f) << 5 | (int)(ball->b * 31.99f);
+            task->values[task->count++] = ((y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE) << 16 | rgb;
+        }
+    }
+    return true;
+}
+
+// Viewport culling, through the bins in view or by scanning this task's balls.
+void cull_balls(void *arg) {
+    CullTask *task = (CullTask *)arg;
+    int needed = 1;
+    if (frame_indexed) {
+        for (int row = task->row0; row < task->row1; row++) {
+            needed += (bin_start[row * bins_x + frame_bx1 + 1] - bin_start[row * bins_x + frame_bx0]) / frame_stride + 1;
+        }
+    } else {
+        needed += (task->end_idx - task->start_idx) / frame_stride;
+    }
+    if (frame_circles && needed > MAX_CIRCLES + 1) needed = MAX_CIRCLES + 1;
+    if (needed > task->capacity) {
+        task->capacity = needed;
+        task->keys = realloc(task->keys, needed * sizeof(uint32_t));
+        task->values = realloc(task->values, needed * sizeof(int));
+    }
+    task->count = 0;
+    if (!frame_indexed) {
+        cull_range(task, NULL, task->start_idx, task->end_idx);
+        return;
+    }
+    for (int row = task->row0; row < task->row1; row++) {
+        if (!cull_range(task, bin_entries, bin_start[row * bins_x + frame_bx0],
+                        bin_start[row * bins_x + frame_bx1 + 1])) break;
+    }
+}
+
+// Triangles of this task's circles, for one glDrawArrays
+void fill_circles(void *arg) {
+    CullTask *task = (CullTask *)arg;
+    for (int e = task->offset; e < task->offset + task->count; e++) {
+        const Ball *ball = &balls[visible[e]];
+        float *v = circle_vertices + (size_t)e * CIRCLE_VERTICES * 2;
+        unsigned char *c = circle_colors + (size_t)e * CIRCLE_VERTICES * 3;
+        for (int k = 0; k < NUM_TRIANGLES; k++) {
+            const float *corner[3] = {circle[0], circle[k + 1], circle[k + 2]};
+            for (int j = 0; j < 3; j++) {
+                *v++ = ball->x + corner[j][0] * ball->radius;
+                *v++ = ball->y + corner[j][1] * ball->radius;
+            }
+        }
+        unsigned char rgb[3] = {ball->r * 255, ball->g * 255, ball->b * 255};
+        for (int k = 0; k < CIRCLE_VERTICES; k++) {
+            memcpy(c + 3 * k, rgb, 3);
+        }
+    }
+}
+
+int lower_bound(const uint32_t *keys, int n, uint32_t key) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (keys[mid] < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Visible balls are sorted by tile, so each task owns one tile's pixels
+// outright and accumulates them in a local buffer that stays in cache.
+// Density shades from the white background towards the mean colour.
+void splat_tile(void *arg) {
+    int tile = *(int *)arg;
+    float accum[TILE_SIZE * TILE_SIZE][4]; // count, r, g, b
+    memset(accum, 0, sizeof(accum));
+    int end = lower_bound(visible_keys, num_visible, tile + 1);
+    for (int e = lower_bound(visible_keys, num_visible, tile); e < end; e++) {
+        int value = visible[e];
+        float *p = accum[value >> 16];
+        p[0] += 1;
+        p[1] += (value >> 11 & 31) / 31.0f;
+        p[2] += (value >> 5 & 63) / 63.0f;
+        p[3] += (value & 31) / 31.0f;
+    }
+    int x0 = (tile % tiles_x) * TILE_SIZE, y0 = (tile / tiles_x) * TILE_SIZE;
+    for (int y = 0; y < TILE_SIZE && y0 + y < win_h; y++) {
+        for (int x = 0; x < TILE_SIZE && x0 + x < win_w; x++) {
+            const float *p = accum[y * TILE_SIZE + x];
+            unsigned char *out = pixels + ((size_t)(y0 + y) * win_w + x0 + x) * 3;
+            if (!p[0]) {
+                out[0] = out[1] = out[2] = 255;
+                continue;
+            }
+            float alpha = coverage[p[0] < OPAQUE_COUNT ? (int)p[0] : OPAQUE_COUNT];
+            float scale = alpha / p[0];
+            for (int c = 0; c < 3; c++) {
+                out[c] = (unsigned char)(255 * (1 - alpha + scale * p[c + 1]));
+            }
+        }
+    }
+}
+
+void cull_frame() {
+    thread_pool_submit(&render_pool, cull_balls, cull_tasks, sizeof(CullTask), num_threads);
+    void *key_lists[NUM_THREADS], *value_lists[NUM_THREADS];
+    int counts[NUM_THREADS];
+    int total = 0;
+    for (int t = 0; t < num_threads; t++) {
+        key_lists[t] = cull_tasks[t].keys;
+        value_lists[t] = cull_tasks[t].values;
+        counts[t] = cull_tasks[t].count;
+        cull_tasks[t].offset = total;
+        total += counts[t];
+    }
+    if (total > max_visible) {
+        max_visible = total;
+        visible_keys = realloc(visible_keys, total * sizeof(uint32_t));
+        tmp_keys = realloc(tmp_keys, total * sizeof(uint32_t));
+        visible = realloc(visible, total * sizeof(int));
+        tmp_visible = realloc(tmp_visible, total * sizeof(int));
+    }
+    parallel_compact(&render_pool, key_lists, counts, num_threads, visible_keys, sizeof(uint32_t));
+    num_visible = parallel_compact(&render_pool, value_lists, counts, num_threads, visible, sizeof(int));
+}
+
+void set_stride(int stride) {
+    if (stride == frame_stride) return;
+    frame_stride = stride;
+    for (int n = 0; n <= OPAQUE_COUNT; n++) {
+        coverage[n] = n < OPAQUE_COUNT ? 1 - expf(-n * stride) : 1;
     }
+}
 
-    thread_pool_shutdown(&pool);
+// Circles when zoomed in far enough and few enough are visible, otherwise
+// a density image built on the CPU. The render index pays off when the view
+// shows less than half the world; otherwise a plain scan reads the balls in
+// memory order.
+void build_frame() {
+    float x0 = view_x, x1 = view_x + win_w / view_scale;
+    float y0 = view_y, y1 = view_y + win_h / view_scale;
+    float shown_w = fminf(x1, WINDOW_WIDTH) - fmaxf(x0, 0);
+    float shown_h = fminf(y1, WINDOW_HEIGHT) - fmaxf(y0, 0);
+    frame_indexed = shown_w < 0 || shown_h < 0 || shown_w * shown_h < 0.5f * WINDOW_WIDTH * WINDOW_HEIGHT;
+    int candidates = num_balls;
+    if (frame_indexed) {
+        update_index();
+        float margin = index_drift() + largest_radius;
+        frame_bx0 = bin_coord(x0 - margin, bins_x);
+        frame_bx1 = bin_coord(x1 + margin, bins_x);
+        int by0 = bin_coord(y0 - margin, bins_y), by1 = bin_coord(y1 + margin, bins_y);
+        candidates = 0;
+        for (int row = by0; row <= by1; row++) {
+            candidates += bin_start[row * bins_x + frame_bx1 + 1] - bin_start[row * bins_x + frame_bx0];
+        }
+        for (int t = 0; t < num_threads; t++) {
+            cull_tasks[t].row0 = by0 + (by1 - by0 + 1) * t / num_threads;
+            cull_tasks[t].row1 = by0 + (by1 - by0 + 1) * (t + 1) / num_threads;
+        }
+    }
+    frame_circles = mean_radius * view_scale >= LOD_PIXELS;
+    if (frame_circles) {
+        set_stride(1);
+        cull_frame();
+        if (num_visible <= MAX_CIRCLES) {
+            thread_pool_submit(&render_pool, fill_circles, cull_tasks, sizeof(CullTask), num_threads);
+            return;
+        }
+        frame_circles = false;
+    }
+    set_stride((candidates + SPLAT_BUDGET - 1) / SPLAT_BUDGET);
+    cull_frame();
+    parallel_radix_sort(&render_pool, visible_keys, visible, num_visible, tiles_x * tiles_y - 1,
+                        tmp_keys, tmp_visible);
+    thread_pool_submit(&render_pool, splat_tile, tile_ids, sizeof(int), tiles_x * tiles_y);
+}
+
+void redisplay(int value) {
+    timer_pending = false;
     glutPostRedisplay();
 }
 
+// Frames read the live state without locking; a frame may mix two steps,
+// which cannot be seen at display rates.
+void display() {
+    double frame_start = now();
+    build_frame();
+    glClear(GL_COLOR_BUFFER_BIT);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    if (frame_circles) {
+        gluOrtho2D(view_x, view_x + win_w / view_scale, view_y, view_y + win_h / view_scale);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glVertexPointer(2, GL_FLOAT, 0, circle_vertices);
+        glColorPointer(3, GL_UNSIGNED_BYTE, 0, circle_colors);
+        glDrawArrays(GL_TRIANGLES, 0, num_visible * CIRCLE_VERTICES);
+        glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+    } else {
+        gluOrtho2D(0, win_w, 0, win_h);
+        glRasterPos2i(0, 0);
+        glDrawPixels(win_w, win_h, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+    }
+    glutSwapBuffers();
+
+    fps_frames++;
+    if (frame_start - fps_start >= 1) {
+        char title[128];
+        snprintf(title, sizeof(title), "Multithreaded Ball Collision Simulation - %.0f FPS, %.0f steps/s%s",
+                 fps_frames / (frame_start - fps_start), (step_count - fps_steps) / (frame_start - fps_start),
+                 frame_circles ? "" : ", density view");
+        glutSetWindowTitle(title);
+        fps_start = frame_start;
+        fps_frames = 0;
+        fps_steps = step_count;
+    }
+    // Reshape and expose also redraw; only one timer may be armed, or each
+    // of those would start another redraw chain.
+    if (!timer_pending) {
+        int wait_ms = (int)(1000.0 / TARGET_FPS - 1000 * (now() - frame_start));
+        glutTimerFunc(wait_ms > 0 ? wait_ms : 0, redisplay, 0);
+        timer_pending = true;
+    }
+}
+
+void reshape(int w, int h) {
+    glViewport(0, 0, w, h);
+    resize_frame(w, h);
+}
+
+// Keeps the world point under screen pixel (sx, sy) in place.
+void zoom_at(float sx, float sy, float factor) {
+    view_x += sx / view_scale - sx / (view_scale * factor);
+    view_y += sy / view_scale - sy / (view_scale * factor);
+    view_scale *= factor;
+}
+
+void mouse(int button, int state, int x, int y) {
+    if ((button == 3 || button == 4) && state == GLUT_DOWN) {
+        zoom_at(x, win_h - y, button == 3 ? 1.25f : 0.8f); // Wheel up, down
+    } else if (button == GLUT_LEFT_BUTTON) {
+        dragging = state == GLUT_DOWN;
+        drag_x = x;
+        drag_y = y;
+    }
+}
+
+void motion(int x, int y) {
+    if (!dragging) return;
+    view_x -= (x - drag_x) / view_scale;
+    view_y += (y - drag_y) / view_scale;
+    drag_x = x;
+    drag_y = y;
+}
+
+void keyboard(unsigned char key, int x, int y) {
+    if (key == '+' || key == '=') zoom_at(win_w / 2.0f, win_h / 2.0f, 1.25f);
+    else if (key == '-') zoom_at(win_w / 2.0f, win_h / 2.0f, 0.8f);
+    else if (key == 'r') view_x = view_y = 0, view_scale = 1;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--threads N] [--seed S] [--deterministic]\n"
+            "          [--broadphase brute|grid] [--radius MIN MAX] [--sleep SPEED]\n"
+            "          [--reorder N] [--balls N] [--scenario uniform|lattice|clustered|packed]\n"
+            "          [--input FILE] [--zoom Z]\n"
+            "          [--steps N [--load FILE] [--save FILE] [--frames N] [--metrics]]\n"
+            "  --radius MIN MAX  log-uniform ball radii (default %d %d)\n"
+            "  --sleep SPEED     islands slower than SPEED for %d steps stop moving\n"
+            "  --reorder N       renumber balls in grid cell order every N steps\n"
+            "  --balls N         number of balls (default %d)\n"
+            "  --scenario S      initial placement; packed rejection-samples without overlap\n"
+            "  --input FILE      read a count line, then \"x y vx vy radius\" per ball\n"
+            "  --zoom Z          initial magnification around the window centre\n"
+            "  --steps N         run N steps headless and print timing and state hash\n"
+            "  --frames N        then time building N frames for the window\n"
+            "  --metrics         also report energy drift, momentum error, overlap, collisions\n"
+            "Window: drag to pan, wheel or +/- to zoom, r to reset\n",
+            prog, BALL_RADIUS, BALL_RADIUS, SLEEP_STEPS, NUM_BALLS);
+    exit(1);
+}
+
 int main(int argc, char **argv) {
+    long steps = -1, frames = 0;
+    float zoom = 1;
+    const char *load_path = NULL, *save_path = NULL, *input_path = NULL;
+    bool seeded = false;
+
     // Register signal handler
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--deterministic")) deterministic = true;
+        else if (!strcmp(argv[i], "--metrics")) metrics = true;
+        else if (i + 1 >= argc) usage(argv[0]);
+        else if (!strcmp(argv[i], "--threads")) num_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seed")) sim_seed = strtoull(argv[++i], NULL, 0), seeded = true;
+        else if (!strcmp(argv[i], "--steps")) steps = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--load")) load_path = argv[++i];
+        else if (!strcmp(argv[i], "--save")) save_path = argv[++i];
+        else if (!strcmp(argv[i], "--sleep")) sleep_speed = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--reorder")) reorder_interval = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--balls")) num_balls = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--frames")) frames = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--zoom")) zoom = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--input")) input_path = argv[++i];
+        else if (!strcmp(argv[i], "--scenario")) {
+            i++;
+            if (!strcmp(argv[i], "uniform")) scenario = SCENARIO_UNIFORM;
+            else if (!strcmp(argv[i], "lattice")) scenario = SCENARIO_LATTICE;
+            else if (!strcmp(argv[i], "clustered")) scenario = SCENARIO_CLUSTERED;
+            else if (!strcmp(argv[i], "packed")) scenario = SCENARIO_PACKED;
+            else usage(argv[0]);
+        }
+        else if (!strcmp(argv[i], "--broadphase")) {
+            i++;
+            if (!strcmp(argv[i], "brute")) broadphase = BROADPHASE_BRUTE;
+            else if (!strcmp(argv[i], "grid")) broadphase = BROADPHASE_GRID;
+            else usage(argv[0]);
+        } else if (!strcmp(argv[i], "--radius") && i + 2 < argc) {
+            min_radius = atof(argv[++i]);
+            max_radius = atof(argv[++i]);
+        }
+        else usage(argv[0]);
+    }
+    if (num_threads < 1 || num_threads > NUM_THREADS || num_balls < 1 || zoom <= 0 || frames < 0) usage(argv[0]);
+    if (sleep_speed < 0 || reorder_interval < 0 || min_radius <= 0 || max_radius < min_radius || 2 * max_radius >= WINDOW_WIDTH ||
+        max_radius > min_radius * (1 << (MAX_LEVELS - 1))) usage(argv[0]);
+    if (!seeded) sim_seed = deterministic ? DEFAULT_SEED : (uint64_t)time(NULL);
+
+    init_circle();
+    thread_pool_init(&pool, num_threads);
+    double init_start = now();
+    if (load_path) {
+        if (load_checkpoint(load_path)) {
+            fprintf(stderr, "Cannot load checkpoint %s\n", load_path);
+            return 1;
+        }
+    } else if (input_path) {
+        if (load_particles(input_path)) {
+            fprintf(stderr, "Cannot read particles from %s\n", input_path);
+            return 1;
+        }
+    } else if (alloc_balls(num_balls) || init_balls()) {
+        fprintf(stderr, "Cannot place %d balls\n", num_balls);
+        return 1;
+    }
+    double init_time = now() - init_start;
+    if (sleep_speed == 0) {
+        // Nothing would ever wake balls restored asleep
+        for (int i = 0; i < num_balls; i++) {
+            balls[i].still = 0;
+        }
+        num_asleep = 0;
+    }
+    init_threads();
+    init_render();
+    zoom_at(win_w / 2.0f, win_h / 2.0f, zoom);
+
+    if (steps >= 0) {
+        printf("balls %d init %.3f s\n", num_balls, init_time);
+        double start_energy, start_px, start_py, energy, px, py;
+        if (metrics) measure(&start_energy, &start_px, &start_py);
+        double start = now();
+        for (long i = 0; i < steps; i++) {
+            step();
+        }
+        double elapsed = now() - start;
+        printf("steps %llu time %.6f s (%.3f ms/step) pair tests/step %ld asleep %d hash %016llx\n",
+               (unsigned long long)step_count, elapsed, steps ? 1e3 * elapsed / steps : 0.0,
+               pair_tests(), num_asleep, (unsigned long long)state_hash());
+        if (metrics) {
+            // Both drifts relative to the starting kinetic energy, momentum as sqrt(2 m E).
+            // Lingering pairs pass right through each other, so the maximum overlap
+            // sits near 1; the mean over all overlapping pairs is what moves.
+            double mass = 0;
+            for (int i = 0; i < num_balls; i++) {
+                mass += balls[i].mass;
+            }
+            measure(&energy, &px, &py);
+            printf("energy drift %.3e momentum error %.3e max overlap %.4f mean overlap %.4f "
+                   "collisions/step %.1f\n",
+                   start_energy ? (energy - start_energy) / start_energy : 0.0,
+                   start_energy ? momentum_error / sqrt(2 * mass * start_energy) : 0.0,
+                   max_overlap, num_hits ? overlap_sum / num_hits : 0.0, steps ? (double)num_hits / steps : 0.0);
+        }
+        if (save_path && save_checkpoint(save_path)) {
+            fprintf(stderr, "Cannot save checkpoint %s\n", save_path);
+            return 1;
+        }
+        if (frames > 0) {
+            start = now();
+            for (long i = 0; i < frames; i++) {
+                build_frame();
+            }
+            elapsed = now() - start;
+            printf("frames %ld time %.6f s (%.3f ms/frame) visible %d stride %d %s %s\n",
+                   frames, elapsed, 1e3 * elapsed / frames, num_visible, frame_stride,
+                   frame_circles ? "circles" : "density", frame_indexed ? "indexed" : "scanned");
+        }
+        thread_pool_shutdown(&render_pool);
+        thread_pool_shutdown(&pool);
+        return 0;
+    }
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB);
     glutInitWindowSize(WINDOW_WIDTH, WINDOW_HEIGHT);
     glutCreateWindow("Multithreaded Ball Collision Simulation");
     init();
-    init_balls();
     glutDisplayFunc(display);
-    glutIdleFunc(update);
+    glutReshapeFunc(reshape);
+    glutMouseFunc(mouse);
+    glutMotionFunc(motion);
+    glutKeyboardFunc(keyboard);
+    pthread_t sim_thread;
+    pthread_create(&sim_thread, NULL, simulate, NULL);
+    fps_start = now();
     glutMainLoop();
     return 0;
 }
-
@@ -0,0 +1,321 @@
+/*
+ * Thread pool and data-parallel primitives (prefix sum, list compaction,
+ * radix sort) shared by the simulation and parallel_bench.
+ */
+
+#define _GNU_SOURCE // pthread_setaffinity_np
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parallel.h"
+
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+// Pin worker id to one CPU unless the pool oversubscribes the machine, so the
+// pages it touches first stay on its NUMA node. CPUs are counted within the
+// affinity mask the worker inherited, so taskset and cpusets are honoured.
+static void pin_worker(const ThreadPool *pool, int id) {
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (pool->num_threads < 2 || sched_getaffinity(0, sizeof(allowed), &allowed)) return;
+    if (pool->first_cpu + pool->num_threads > CPU_COUNT(&allowed)) return;
+    id += pool->first_cpu;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || id-- > 0) continue;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        return;
+    }
+#endif
+}
+
+static void *thread_pool_worker(void *arg) {
+    ThreadPool *pool = (ThreadPool *)arg;
+    int seen = 0; // Generation of the last batch this worker ran
+    pthread_mutex_lock(&pool->queue_mutex);
+    int id = pool->next_id++;
+    pthread_mutex_unlock(&pool->queue_mutex);
+    pin_worker(pool, id);
+    pthread_mutex_lock(&pool->queue_mutex);
+    while (1) {
+        while (pool->generation == seen && !pool->stop) {
+            pthread_cond_wait(&pool->queue_cond, &pool->queue_mutex);
+        }
+        if (pool->stop) {
+            break;
+        }
+        seen = pool->generation;
+        void (*task)(void *) = pool->task;
+        char *task_args = pool->task_args;
+        size_t arg_size = pool->arg_size;
+        int num_tasks = pool->num_tasks;
+        pthread_mutex_unlock(&pool->queue_mutex);
+        int done = 0;
+        for (int t = id; t < num_tasks; t += pool->num_threads) {
+            task(task_args + t * arg_size);
+            done++;
+        }
+        pthread_mutex_lock(&pool->queue_mutex);
+        pool->pending -= done;
+        if (pool->pending == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->queue_mutex);
+    return NULL;
+}
+
+void thread_pool_init(ThreadPool *pool, int num_threads) {
+    thread_pool_init_at(pool, num_threads, 0);
+}
+
+void thread_pool_init_at(ThreadPool *pool, int num_threads, int first_cpu) {
+    pool->num_threads = num_threads;
+    pool->first_cpu = first_cpu;
+    pool->threads = malloc(num_threads * sizeof(pthread_t));
+    pthread_mutex_init(&pool->queue_mutex, NULL);
+    pthread_cond_init(&pool->queue_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->task = NULL;
+    pool->num_tasks = pool->pending = 0;
+    pool->generation = 0;
+    pool->next_id = 0;
+    pool->stop = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool);
+    }
+}
+
+void thread_pool_submit(ThreadPool *pool, void (*task)(void *), void *args, size_t arg_size, int count) {
+    if (count == 0) return;
+    pthread_mutex_lock(&pool->queue_mutex);
+    pool->task = task;
+    pool->task_args = args;
+    pool->arg_size = arg_size;
+    pool->num_tasks = pool->pending = count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->queue_cond);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->queue_mutex);
+    }
+    pthread_mutex_unlock(&pool->queue_mutex);
+}
+
+void thread_pool_shutdown(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->queue_mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->queue_cond);
+    pthread_mutex_unlock(&pool->queue_mutex);
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->queue_mutex);
+    pthread_cond_destroy(&pool->queue_cond);
+    pthread_cond_destroy(&pool->done_cond);
+}
+
+static void block_range(int n, int parts, int b, int *start, int *end) {
+    *start = (int)((long long)n * b / parts);
+    *end = (int)((long long)n * (b + 1) / parts);
+}
+
+typedef struct {
+    int *data;
+    int start, end;
+    int sum; // Block total after the first pass, block offset for the second
+} ScanBlock;
+
+static void scan_sum_block(void *arg) {
+    ScanBlock *block = (ScanBlock *)arg;
+    int sum = 0;
+    for (int i = block->start; i < block->end; i++) {
+        sum += block->data[i];
+    }
+    block->sum = sum;
+}
+
+static void scan_block(void *arg) {
+    ScanBlock *block = (ScanBlock *)arg;
+    int running = block->sum;
+    for (int i = block->start; i < block->end; i++) {
+        int value = block->data[i];
+        block->data[i] = running;
+        running += value;
+    }
+}
+
+int serial_scan(int *data, int n) {
+    int running = 0;
+    for (int i = 0; i < n; i++) {
+        int value = data[i];
+        data[i] = running;
+        running += value;
+    }
+    return running;
+}
+
+int parallel_scan(ThreadPool *pool, int *data, int n) {
+    int parts = pool->num_threads;
+    if (n < PARALLEL_MIN || parts == 1) return serial_scan(data, n);
+    ScanBlock blocks[parts];
+    for (int b = 0; b < parts; b++) {
+        blocks[b].data = data;
+        block_range(n, parts, b, &blocks[b].start, &blocks[b].end);
+    }
+    thread_pool_submit(pool, scan_sum_block, blocks, sizeof(ScanBlock), parts);
+    int total = 0;
+    for (int b = 0; b < parts; b++) {
+        int sum = blocks[b].sum;
+        blocks[b].sum = total;
+        total += sum;
+    }
+    thread_pool_submit(pool, scan_block, blocks, sizeof(ScanBlock), parts);
+    return total;
+}
+
+typedef struct {
+    void *const *lists;
+    const int *offsets; // num_lists + 1 output offsets
+    int num_lists;
+    char *dst;
+    size_t size;
+    int start, end;     // Output range, which may span several lists
+} CompactBlock;
+
+static void compact_block(void *arg) {
+    CompactBlock *block = (CompactBlock *)arg;
+    int l = 0;
+    while (l < block->num_lists && block->offsets[l + 1] <= block->start) l++;
+    for (int i = block->start; i < block->end; l++) {
+        int end = block->offsets[l + 1] < block->end ? block->offsets[l + 1] : block->end;
+        const char *src = (const char *)block->lists[l] + (i - block->offsets[l]) * block->size;
+        memcpy(block->dst + i * block->size, src, (end - i) * block->size);
+        i = end;
+    }
+}
+
+int serial_compact(void *const *lists, const int *counts, int num_lists, void *dst, size_t size) {
+    int total = 0;
+    for (int l = 0; l < num_lists; l++) {
+        memcpy((char *)dst + total * size, lists[l], counts[l] * size);
+        total += counts[l];
+    }
+    return total;
+}
+
+// Blocks split the output evenly, so one long list does not serialize the copy.
+int parallel_compact(ThreadPool *pool, void *const *lists, const int *counts, int num_lists,
+                     void *dst, size_t size) {
+    int offsets[num_lists + 1];
+    memcpy(offsets, counts, num_lists * sizeof(int));
+    int total = offsets[num_lists] = serial_scan(offsets, num_lists);
+    int parts = pool->num_threads;
+    if (total < PARALLEL_MIN || parts == 1) return serial_compact(lists, counts, num_lists, dst, size);
+    CompactBlock blocks[parts];
+    for (int b = 0; b < parts; b++) {
+        blocks[b] = (CompactBlock){lists, offsets, num_lists, dst, size, 0, 0};
+        block_range(total, parts, b, &blocks[b].start, &blocks[b].end);
+    }
+    thread_pool_submit(pool, compact_block, blocks, sizeof(CompactBlock), parts);
+    return total;
+}
+
+typedef struct {
+    const uint32_t *keys;
+    const int *values;
+    uint32_t *out_keys;
+    int *out_values;
+    int start, end;
+    int shift;
+    int count[RADIX_SIZE]; // Digit histogram, then this block's scatter offsets
+} RadixBlock;
+
+// Locals rather than block fields in the loops: the stores through out_values
+// could otherwise alias count and force a reload per element.
+static void radix_count_block(void *arg) {
+    RadixBlock *block = (RadixBlock *)arg;
+    const uint32_t *keys = block->keys;
+    int shift = block->shift, end = block->end;
+    int count[RADIX_SIZE] = {0};
+    for (int i = block->start; i < end; i++) {
+        count[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+    }
+    memcpy(block->count, count, sizeof(count));
+}
+
+static void radix_scatter_block(void *arg) {
+    RadixBlock *block = (RadixBlock *)arg;
+    const uint32_t *keys = block->keys;
+    const int *values = block->values;
+    uint32_t *out_keys = block->out_keys;
+    int *out_values = block->out_values;
+    int shift = block->shift, end = block->end;
+    int next[RADIX_SIZE];
+    memcpy(next, block->count, sizeof(next));
+    for (int i = block->start; i < end; i++) {
+        int k = next[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+        out_keys[k] = keys[i];
+        out_values[k] = values[i];
+    }
+}
+
+// Stability comes from giving digit d of block b the slots after digit d of
+// blocks 0..b-1; each block then scatters its own range in input order.
+static void radix_sort(ThreadPool *pool, int parts, uint32_t *keys, int *values, int n,
+                       uint32_t max_key, uint32_t *tmp_keys, int *tmp_values) {
+    RadixBlock blocks[parts];
+    uint32_t *src_keys = keys, *dst_keys = tmp_keys;
+    int *src_values = values, *dst_values = tmp_values;
+    for (int shift = 0; shift == 0 || (shift < 32 && (max_key >> shift)); shift += RADIX_BITS) {
+        for (int b = 0; b < parts; b++) {
+            blocks[b].keys = src_keys;
+            blocks[b].values = src_values;
+            blocks[b].out_keys = dst_keys;
+            blocks[b].out_values = dst_values;
+            blocks[b].shift = shift;
+            block_range(n, parts, b, &blocks[b].start, &blocks[b].end);
+        }
+        if (pool) thread_pool_submit(pool, radix_count_block, blocks, sizeof(RadixBlock), parts);
+        else radix_count_block(&blocks[0]);
+        int running = 0;
+        for (int d = 0; d < RADIX_SIZE; d++) {
+            for (int b = 0; b < parts; b++) {
+                int count = blocks[b].count[d];
+                blocks[b].count[d] = running;
+                running += count;
+            }
+        }
+        if (pool) thread_pool_submit(pool, radix_scatter_block, blocks, sizeof(RadixBlock), parts);
+        else radix_scatter_block(&blocks[0]);
+        uint32_t *swap_keys = src_keys;
+        src_keys = dst_keys;
+        dst_keys = swap_keys;
+        int *swap_values = src_values;
+        src_values = dst_values;
+        dst_values = swap_values;
+    }
+    if (src_keys != keys) {
+        memcpy(keys, src_keys, n * sizeof(uint32_t));
+        memcpy(values, src_values, n * sizeof(int));
+    }
+}
+
+void serial_radix_sort(uint32_t *keys, int *values, int n, uint32_t max_key,
+                       uint32_t *tmp_keys, int *tmp_values) {
+    radix_sort(NULL, 1, keys, values, n, max_key, tmp_keys, tmp_values);
+}
+
+void parallel_radix_sort(ThreadPool *pool, uint32_t *keys, int *values, int n, uint32_t max_key,
+                         uint32_t *tmp_keys, int *tmp_values) {
+    if (n < PARALLEL_MIN || pool->num_threads == 1) {
+        serial_radix_sort(keys, values, n, max_key, tmp_keys, tmp_values);
+        return;
+    }
+    radix_sort(pool, pool->num_threads, keys, values, n, max_key, tmp_keys, tmp_values);
+}
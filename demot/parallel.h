@@ -0,0 +1,60 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Inputs shorter than this run serially; dispatch would cost more than it saves.
+#define PARALLEL_MIN 65536
+
+typedef struct {
+    pthread_t *threads;
+    int num_threads;
+    int first_cpu;     // Workers are pinned from this allowed CPU on
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t queue_cond;
+    pthread_cond_t done_cond;
+    void (*task)(void *);
+    char *task_args;   // Array of num_tasks arguments, arg_size bytes each
+    size_t arg_size;
+    int num_tasks;
+    int pending;
+    int generation;    // Bumped by every submit
+    int next_id;
+    int stop;
+} ThreadPool;
+
+void thread_pool_init(ThreadPool *pool, int num_threads);
+// Same, with worker t pinned to allowed CPU first_cpu + t, so pools running
+// side by side do not share CPUs; unpinned if the machine has too few.
+void thread_pool_init_at(ThreadPool *pool, int num_threads, int first_cpu);
+// Runs task once for each of the count arguments and returns when all are done.
+// Task t always runs on worker t % num_threads, so data a task touches first is
+// placed near the worker that keeps processing it.
+void thread_pool_submit(ThreadPool *pool, void (*task)(void *), void *args, size_t arg_size, int count);
+void thread_pool_shutdown(ThreadPool *pool);
+
+// All primitives split their input into one contiguous block per pool thread
+// and give the same result as their serial counterpart for any thread count.
+
+// Exclusive prefix sum in place; returns the total.
+int parallel_scan(ThreadPool *pool, int *data, int n);
+
+// Concatenates lists[0..num_lists) of counts[l] elements of size bytes into
+// dst, in list order; returns the number of elements written.
+int parallel_compact(ThreadPool *pool, void *const *lists, const int *counts, int num_lists,
+                     void *dst, size_t size);
+
+// Stable LSD radix sort of keys (below max_key + 1) carrying values along.
+// tmp_keys and tmp_values are scratch space of n elements each.
+void parallel_radix_sort(ThreadPool *pool, uint32_t *keys, int *values, int n, uint32_t max_key,
+                         uint32_t *tmp_keys, int *tmp_values);
+
+// Serial versions, used below PARALLEL_MIN and as benchmark baselines.
+int serial_scan(int *data, int n);
+int serial_compact(void *const *lists, const int *counts, int num_lists, void *dst, size_t size);
+void serial_radix_sort(uint32_t *keys, int *values, int n, uint32_t max_key,
+                       uint32_t *tmp_keys, int *tmp_values);
+
+#endif
@@ -0,0 +1,164 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parallel.h"
+
+#define NUM_THREADS 24
+#define DEFAULT_N 10000000
+#define REPEATS 5
+
+typedef struct {
+    int a;
+    int b;
+} Pair;
+
+void tic(struct timespec *start) {
+    clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+double toc(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void report(const char *name, double serial, double parallel, int ok) {
+    printf("%-12s serial %9.3f ms  parallel %9.3f ms  speedup %5.2fx  %s\n",
+           name, 1e3 * serial, 1e3 * parallel, serial / parallel, ok ? "ok" : "MISMATCH");
+}
+
+// Best of REPEATS; every primitive overwrites its input, so inputs are restored
+// from a pristine copy outside the timed region.
+int bench_scan(ThreadPool *pool, int n) {
+    int *input = malloc(n * sizeof(int));
+    int *serial = malloc(n * sizeof(int));
+    int *parallel = malloc(n * sizeof(int));
+    struct timespec start;
+    double best_serial = 1e30, best_parallel = 1e30;
+    for (int i = 0; i < n; i++) {
+        input[i] = rand() % 4;
+    }
+    int serial_total = 0, parallel_total = 0;
+    for (int r = 0; r < REPEATS; r++) {
+        memcpy(serial, input, n * sizeof(int));
+        tic(&start);
+        serial_total = serial_scan(serial, n);
+        double t = toc(&start);
+        if (t < best_serial) best_serial = t;
+
+        memcpy(parallel, input, n * sizeof(int));
+        tic(&start);
+        parallel_total = parallel_scan(pool, parallel, n);
+        t = toc(&start);
+        if (t < best_parallel) best_parallel = t;
+    }
+    int ok = serial_total == parallel_total && !memcmp(serial, parallel, n * sizeof(int));
+    report("scan", best_serial, best_parallel, ok);
+    free(input);
+    free(serial);
+    free(parallel);
+    return ok;
+}
+
+// Per-thread candidate lists of uneven length, as the contact pass produces.
+int bench_compact(ThreadPool *pool, int n) {
+    int num_lists = pool->num_threads;
+    void *lists[num_lists];
+    int counts[num_lists];
+    int remaining = n;
+    for (int l = 0; l < num_lists; l++) {
+        counts[l] = l == num_lists - 1 ? remaining : remaining / 2;
+        remaining -= counts[l];
+        Pair *list = malloc((counts[l] + 1) * sizeof(Pair));
+        for (int i = 0; i < counts[l]; i++) {
+            list[i] = (Pair){l, i};
+        }
+        lists[l] = list;
+    }
+    Pair *serial = malloc(n * sizeof(Pair));
+    Pair *parallel = malloc(n * sizeof(Pair));
+    struct timespec start;
+    double best_serial = 1e30, best_parallel = 1e30;
+    int serial_total = 0, parallel_total = 0;
+    for (int r = 0; r < REPEATS; r++) {
+        tic(&start);
+        serial_total = serial_compact(lists, counts, num_lists, serial, sizeof(Pair));
+        double t = toc(&start);
+        if (t < best_serial) best_serial = t;
+
+        tic(&start);
+        parallel_total = parallel_compact(pool, lists, counts, num_lists, parallel, sizeof(Pair));
+        t = toc(&start);
+        if (t < best_parallel) best_parallel = t;
+    }
+    int ok = serial_total == n && parallel_total == n && !memcmp(serial, parallel, n * sizeof(Pair));
+    report("compact", best_serial, best_parallel, ok);
+    for (int l = 0; l < num_lists; l++) {
+        free(lists[l]);
+    }
+    free(serial);
+    free(parallel);
+    return ok;
+}
+
+// Cell keys as the grid produces them: about one cell per particle.
+int bench_radix_sort(ThreadPool *pool, int n) {
+    uint32_t *input = malloc(n * sizeof(uint32_t));
+    uint32_t *keys[2] = {malloc(n * sizeof(uint32_t)), malloc(n * sizeof(uint32_t))};
+    int *values[2] = {malloc(n * sizeof(int)), malloc(n * sizeof(int))};
+    uint32_t *tmp_keys = malloc(n * sizeof(uint32_t));
+    int *tmp_values = malloc(n * sizeof(int));
+    struct timespec start;
+    double best[2] = {1e30, 1e30};
+    for (int i = 0; i < n; i++) {
+        input[i] = (uint32_t)(((unsigned long long)rand() * RAND_MAX + rand()) % n);
+    }
+    for (int r = 0; r < REPEATS; r++) {
+        for (int p = 0; p < 2; p++) {
+            memcpy(keys[p], input, n * sizeof(uint32_t));
+            for (int i = 0; i < n; i++) {
+                values[p][i] = i;
+            }
+            tic(&start);
+            if (p == 0) serial_radix_sort(keys[p], values[p], n, n - 1, tmp_keys, tmp_values);
+            else parallel_radix_sort(pool, keys[p], values[p], n, n - 1, tmp_keys, tmp_values);
+            double t = toc(&start);
+            if (t < best[p]) best[p] = t;
+        }
+    }
+    int ok = !memcmp(keys[0], keys[1], n * sizeof(uint32_t)) && !memcmp(values[0], values[1], n * sizeof(int));
+    for (int i = 1; ok && i < n; i++) {
+        ok = keys[0][i - 1] < keys[0][i] || (keys[0][i - 1] == keys[0][i] && values[0][i - 1] < values[0][i]);
+    }
+    report("radix sort", best[0], best[1], ok);
+    free(input);
+    for (int p = 0; p < 2; p++) {
+        free(keys[p]);
+        free(values[p]);
+    }
+    free(tmp_keys);
+    free(tmp_values);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : DEFAULT_N;
+    int num_threads = argc > 2 ? atoi(argv[2]) : NUM_THREADS;
+    if (n < 1 || num_threads < 1) {
+        fprintf(stderr, "Usage: %s [N] [THREADS]\n", argv[0]);
+        return 1;
+    }
+    ThreadPool pool;
+    thread_pool_init(&pool, num_threads);
+    srand(1);
+    printf("n %d threads %d (best of %d)\n", n, num_threads, REPEATS);
+    int ok = bench_scan(&pool, n);
+    ok &= bench_compact(&pool, n);
+    ok &= bench_radix_sort(&pool, n);
+    thread_pool_shutdown(&pool);
+    return ok ? 0 : 1;
+}